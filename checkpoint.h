@@ -0,0 +1,446 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#include "filesystem.h"
+#include "integrity.h"
+
+// Checkpoints of the file system state.
+//
+// The command thread only takes a snapshot: file metadata is copied, block
+// payloads and block lists are shared through BlockStore's chunks and
+// BlockList's segments. A background thread then serializes the snapshot
+// with large sequential writes into "<path>.tmp", fsyncs it and renames it
+// over <path>, so a reader never sees a torn file.
+//
+// Format: a "#files <count>" line, then for every file a "<name>
+// <deletionMark> <lastUpdated> <latestBlockCount> <crc>" line followed by a
+// line of block indices, where crc is the crc32c of both lines without the
+// crc field itself. Then a "#blocks <count>" line and, per block, a
+// "<length> <crc>" line followed by the raw bytes and a newline. Backups
+// written before checksums existed lack the crc fields and load unverified.
+// Backups without the "#files" line end the records at the first line that
+// starts with "#blocks ", which a file of that name would cut short.
+
+struct FileRecord {
+    std::string name;
+    FileMetadata metadata;
+    BlockList allocatedBlocks; // shares the file's segments
+    size_t latestBlockCount;
+};
+
+struct CheckpointView {
+    std::vector<FileRecord> files;
+    BlockStore blocks;
+};
+
+inline std::shared_ptr<CheckpointView> takeSnapshot(const FileSystem& fs) {
+    if (fs.trace) {
+        fs.trace->record(TraceOp::Save);
+    }
+    std::shared_ptr<CheckpointView> view = std::make_shared<CheckpointView>();
+    view->files.reserve(fs.files.size());
+    for (const File& file : fs.files) {
+        view->files.push_back(FileRecord{std::string(file.name.data(), file.name.size()), file.metadata,
+                                         file.allocatedBlocks, file.latestBlockCount});
+    }
+    view->blocks = fs.dataBlocks;
+    return view;
+}
+
+// Writes separator (unless 0) and value in decimal to digits, which must have
+// room for 22 characters; returns the end of the text
+template <typename Number>
+inline char* formatNumber(char* digits, char separator, Number value) {
+    if (separator) {
+        *digits++ = separator;
+    }
+    return std::to_chars(digits, digits + 21, value).ptr;
+}
+
+template <typename Number>
+inline void appendNumber(std::string& text, char separator, Number value) {
+    char digits[24];
+    text.append(digits, formatNumber(digits, separator, value) - digits);
+}
+
+// Buffered writer over a raw descriptor; everything reaches the kernel in
+// bufferSize writes.
+struct CheckpointWriter {
+    static const size_t bufferSize = 4 << 20;
+
+    int fd;
+    std::vector<char> buffer;
+    size_t used = 0;
+    uint64_t written = 0;
+    bool failed = false;
+
+    explicit CheckpointWriter(int f) : fd(f), buffer(bufferSize) {}
+
+    void append(const char* data, size_t size) {
+        while (size > 0) {
+            size_t n = std::min(size, bufferSize - used);
+            std::memcpy(buffer.data() + used, data, n);
+            used += n;
+            data += n;
+            size -= n;
+            if (used == bufferSize) {
+                flush();
+            }
+        }
+    }
+
+    void append(std::string_view text) {
+        append(text.data(), text.size());
+    }
+
+    // Appends separator (unless 0) and value in decimal
+    template <typename Number>
+    void appendNumber(char separator, Number value) {
+        char digits[24];
+        char* end = formatNumber(digits, separator, value);
+        append(digits, end - digits);
+    }
+
+    void flush() {
+        size_t done = 0;
+        while (done < used && !failed) {
+            ssize_t n = ::write(fd, buffer.data() + done, used - done);
+            if (n < 0 && errno != EINTR) {
+                failed = true;
+            } else if (n > 0) {
+                done += n;
+                written += n;
+            }
+        }
+        used = 0;
+    }
+};
+
+inline bool writeCheckpoint(const CheckpointView& view, const std::string& path) {
+    FS_TIME_OP(Op::CheckpointWrite);
+    std::string tmpPath = path + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Checkpoint failed: cannot open '" << tmpPath << "': " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    CheckpointWriter out(fd);
+    out.append("#files");
+    out.appendNumber(' ', view.files.size());
+    out.append("\n", 1);
+    // Both lines of a record are formatted into one reused buffer, since the
+    // crc covers them together: header, '\n', indices
+    std::string record;
+    for (const FileRecord& file : view.files) {
+        record.assign(file.name);
+        appendNumber(record, ' ', static_cast<int>(file.metadata.deletionMark));
+        appendNumber(record, ' ', file.metadata.lastUpdated);
+        appendNumber(record, ' ', file.latestBlockCount);
+        size_t headerLength = record.size();
+        record += '\n';
+        for (int blockIndex : file.allocatedBlocks) {
+            appendNumber(record, 0, blockIndex);
+            record += ' ';
+        }
+        std::string_view text = record;
+        out.append(text.substr(0, headerLength));
+        out.appendNumber(' ', crc32c(text));
+        out.append(text.substr(headerLength));
+        out.append("\n", 1);
+    }
+    out.append("#blocks");
+    out.appendNumber(' ', view.blocks.size());
+    out.append("\n", 1);
+    for (size_t i = 0; i < view.blocks.size(); i++) {
+        const DataBlock& block = view.blocks[i];
+        std::string_view content = block.content;
+        out.appendNumber(0, content.size());
+        out.appendNumber(' ', block.checksum);
+        out.append("\n", 1);
+        out.append(content);
+        out.append("\n", 1);
+    }
+    out.flush();
+
+    bool ok = !out.failed && ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "Checkpoint failed: cannot write '" << path << "': " << std::strerror(errno) << std::endl;
+        ::unlink(tmpPath.c_str());
+        return false;
+    }
+
+    // Make the rename itself durable
+    std::string::size_type slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int dirFd = ::open(dir.c_str(), O_RDONLY);
+    if (dirFd >= 0) {
+        ::fsync(dirFd);
+        ::close(dirFd);
+    }
+    FS_COUNT(Counter::CheckpointBytes, out.written);
+    return true;
+}
+
+// Parses up to max whitespace-separated numbers from text; returns how many
+inline int parseNumbers(const char* text, uint64_t* numbers, int max) {
+    int count = 0;
+    while (count < max) {
+        char* end;
+        uint64_t value = std::strtoull(text, &end, 10);
+        if (end == text) {
+            break;
+        }
+        numbers[count++] = value;
+        text = end;
+    }
+    return count;
+}
+
+enum class LoadResult { Missing, Loaded, Damaged };
+
+// Every record and block checksum is verified, and each mismatch is reported
+// with the file it hits; the indices of bad blocks are also stored in
+// corruptBlocks if given. Damaged means something was reported and the file
+// system holds only what could be recovered, so the backup should be kept
+// rather than overwritten.
+inline LoadResult loadCheckpoint(FileSystem& fs, const std::string& path, std::vector<size_t>* corruptBlocks = nullptr) {
+    FS_TIME_OP(Op::Load);
+    if (fs.trace) {
+        fs.trace->record(TraceOp::Load);
+    }
+    std::ifstream backupFile(path, std::ios::binary);
+    if (!backupFile) {
+        return LoadResult::Missing;
+    }
+    bool damaged = false;
+
+    fs.clear();
+
+    // line, header and payload are reused, so parsing allocates nothing per
+    // record once they have grown to size
+    std::string line;
+    std::string header;
+    std::string payload;
+    uint64_t numbers[4];
+    int trailingCount = 0;
+    uint32_t recordCrc = 0;
+    size_t nameLength = 0;
+    bool haveHeader = false; // a record is kept only once its indices line is read
+    bool keepRecord = false; // false: the header was unreadable, drop the indices line too
+
+    bool counted = false;
+    uint64_t fileCount = 0;
+    uint64_t recordsLeft = 0;
+    if (backupFile.peek() == '#') {
+        std::getline(backupFile, line);
+        if (line.compare(0, 7, "#files ") == 0) {
+            counted = true;
+            fileCount = std::strtoull(line.c_str() + 7, nullptr, 10);
+            recordsLeft = fileCount;
+        } else {
+            backupFile.clear();
+            backupFile.seekg(0);
+        }
+    }
+
+    while (std::getline(backupFile, line)) {
+        if (!haveHeader) {
+            if (counted ? recordsLeft == 0 : line.compare(0, 8, "#blocks ") == 0) {
+                break;
+            }
+            // "<name> <deletionMark> <lastUpdated>", then "<latestBlockCount> <crc>";
+            // older formats lack the latest block count, or it and the crc
+            size_t space = line.find(' ');
+            int count = space == 0 || space == std::string::npos ? 0 : parseNumbers(line.c_str() + space, numbers, 4);
+            if (counted && count != 4) {
+                // Every record has both fields since "#files"; rereading the
+                // indices line as an older header would misalign the rest
+                std::cout << "Unreadable metadata record " << fileCount - recordsLeft + 1 << " of " << fileCount
+                          << std::endl;
+                damaged = true;
+                keepRecord = false;
+                haveHeader = true;
+                continue;
+            }
+            if (count < 2) {
+                continue;
+            }
+            keepRecord = true;
+            nameLength = space;
+            trailingCount = count - 2;
+            recordCrc = trailingCount > 0 ? numbers[count - 1] : 0;
+            header.assign(line, 0, trailingCount > 0 ? line.rfind(' ') : line.size());
+            haveHeader = true;
+        } else if (!keepRecord) {
+            haveHeader = false;
+            recordsLeft--;
+        } else {
+            File& file = fs.files.emplace_back(std::string_view(header).substr(0, nameLength));
+            file.metadata.deletionMark = numbers[0] != 0;
+            file.metadata.lastUpdated = numbers[1];
+            const char* text = line.c_str();
+            char* end;
+            errno = 0;
+            for (long blockIndex = std::strtol(text, &end, 10); end != text; blockIndex = std::strtol(text, &end, 10)) {
+                if (errno == ERANGE || blockIndex < INT_MIN || blockIndex > INT_MAX) {
+                    std::cout << "Bad block index: file '" << file.name << "' " << std::string_view(text, end - text) << std::endl;
+                    damaged = true;
+                    break;
+                }
+                file.allocatedBlocks.push_back(static_cast<int>(blockIndex));
+                text = end;
+            }
+            file.latestBlockCount = trailingCount == 2 ? numbers[2] : file.allocatedBlocks.size();
+            if (trailingCount > 0 && crc32cUpdate(crc32cUpdate(crc32c(header), "\n", 1), line) != recordCrc) {
+                std::cout << "Checksum mismatch: metadata record of file '" << file.name << "'" << std::endl;
+                FS_COUNT(Counter::ChecksumFailures, 1);
+                damaged = true;
+            }
+            haveHeader = false;
+            recordsLeft -= counted;
+        }
+    }
+
+    if (counted && recordsLeft > 0) {
+        std::cout << "Backup is truncated after file " << fs.files.size() << std::endl;
+        damaged = true;
+    }
+
+    // Block payloads; older backups stop before this section
+    bool hasBlocks = !backupFile.eof();
+    while (std::getline(backupFile, line)) {
+        char* end;
+        size_t length = std::strtoull(line.c_str(), &end, 10);
+        if (end == line.c_str() || length > BlockStore::blockSize) {
+            // The payload cannot be skipped without a trustworthy length
+            std::cout << "Bad block header: block " << fs.dataBlocks.size() << " '" << line << "'" << std::endl;
+            damaged = true;
+            break;
+        }
+        payload.resize(length);
+        if (!backupFile.read(&payload[0], length) || backupFile.get() != '\n') {
+            std::cout << "Backup is truncated after block " << fs.dataBlocks.size() << std::endl;
+            damaged = true;
+            break;
+        }
+        // Blocks from backups without checksums start out trusted
+        fs.dataBlocks.append(payload, *end == ' ' ? std::strtoul(end + 1, nullptr, 10) : crc32c(payload));
+    }
+    fs.nextBlockIndex = fs.dataBlocks.size();
+    fs.rebuildIndex();
+
+    std::vector<size_t> badBlocks = verifyBlocks(fs.dataBlocks);
+    reportCorruptBlocks(fs, badBlocks);
+    damaged = damaged || !badBlocks.empty();
+    if (corruptBlocks) {
+        corruptBlocks->swap(badBlocks);
+    }
+    for (const File& file : fs.files) {
+        for (int blockIndex : file.allocatedBlocks) {
+            if (hasBlocks && (blockIndex < 0 || static_cast<size_t>(blockIndex) >= fs.dataBlocks.size())) {
+                std::cout << "Missing block: file '" << file.name << "' block " << blockIndex << std::endl;
+                FS_COUNT(Counter::ChecksumFailures, 1);
+                damaged = true;
+            }
+        }
+    }
+    fs.refreshGauges();
+    return damaged ? LoadResult::Damaged : LoadResult::Loaded;
+}
+
+// Background checkpoint thread. Requests made while a checkpoint is being
+// written are coalesced: only the newest pending snapshot gets written.
+struct Checkpointer {
+    std::string path;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::shared_ptr<CheckpointView> pending;
+    uint64_t requested = 0;
+    uint64_t completed = 0;
+    uint64_t succeeded = 0; // newest ticket whose state reached the disk
+    bool stopping = false;
+    std::thread worker;
+
+    explicit Checkpointer(std::string p) : path(p) {
+        worker = std::thread([this] { run(); });
+    }
+
+    // Writes whatever is still pending before the thread exits
+    ~Checkpointer() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    // Returns a ticket that can be passed to waitFor()
+    uint64_t request(std::shared_ptr<CheckpointView> view) {
+        uint64_t ticket;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending = view;
+            ticket = ++requested;
+        }
+        wake.notify_one();
+        return ticket;
+    }
+
+    // Returns whether the state of ticket, or a newer one, was written
+    bool waitFor(uint64_t ticket) {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [this, ticket] { return completed >= ticket; });
+        return succeeded >= ticket;
+    }
+
+    void run() {
+#ifdef __linux__
+        // Per-thread nice value: yield the CPU to the command thread
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+#endif
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return pending || stopping; });
+            if (!pending) {
+                return;
+            }
+            std::shared_ptr<CheckpointView> view = pending;
+            uint64_t ticket = requested;
+            pending.reset();
+
+            guard.unlock();
+            bool ok = writeCheckpoint(*view, path);
+            view.reset();
+            guard.lock();
+
+            completed = ticket;
+            if (ok) {
+                succeeded = ticket;
+            }
+            done.notify_all();
+        }
+    }
+};
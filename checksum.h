@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has it
+// and a slicing-by-8 table otherwise; both produce the same values.
+
+struct Crc32cTable {
+    uint32_t entries[8][256];
+
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            }
+            entries[0][i] = crc;
+        }
+        for (int i = 0; i < 256; i++) {
+            for (int slice = 1; slice < 8; slice++) {
+                uint32_t previous = entries[slice - 1][i];
+                entries[slice][i] = (previous >> 8) ^ entries[0][previous & 0xff];
+            }
+        }
+    }
+};
+
+inline uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t size) {
+    static const Crc32cTable table;
+    const uint32_t (*t)[256] = table.entries;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        word ^= crc;
+        crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^ t[5][(word >> 16) & 0xff] ^
+              t[4][(word >> 24) & 0xff] ^ t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+              t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xff];
+        data++;
+        size--;
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size > 0) {
+        crc = _mm_crc32_u8(crc, *data);
+        data++;
+        size--;
+    }
+    return crc;
+}
+#endif
+
+// Extends crc, the crc32c of some earlier bytes, to cover data as well
+inline uint32_t crc32cUpdate(uint32_t crc, const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return ~crc32cHardware(~crc, bytes, size);
+    }
+#endif
+    return ~crc32cSoftware(~crc, bytes, size);
+}
+
+inline uint32_t crc32cUpdate(uint32_t crc, std::string_view data) {
+    return crc32cUpdate(crc, data.data(), data.size());
+}
+
+inline uint32_t crc32c(const void* data, size_t size) {
+    return crc32cUpdate(0, data, size);
+}
+
+inline uint32_t crc32c(std::string_view data) {
+    return crc32cUpdate(0, data.data(), data.size());
+}
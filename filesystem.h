@@ -0,0 +1,452 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "checksum.h"
+#include "stats.h"
+#include "trace.h"
+
+struct FileMetadata {
+    bool deletionMark = false;
+    std::time_t lastUpdated = std::time(0);
+};
+
+// Not allocator-aware on purpose: content keeps the allocator it was created
+// with (the file system's version arena) when versions are moved around.
+struct FileVersion {
+    std::time_t timestamp;
+    std::pmr::string content;
+};
+
+// Shared, fixed-size array of block indices taken with a single allocation:
+// the reference count and the indices share one block. Copies share the
+// array; the last one to go frees it, from whichever thread that is.
+class BlockSegment {
+    struct Header {
+        std::atomic<size_t> references;
+    };
+
+    Header* header = nullptr;
+
+    void release() {
+        if (header && header->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            header->~Header();
+            ::operator delete(header);
+        }
+    }
+
+public:
+    BlockSegment() = default;
+
+    explicit BlockSegment(size_t size)
+        : header(new (::operator new(sizeof(Header) + size * sizeof(int))) Header{{1}}) {}
+
+    BlockSegment(const BlockSegment& other) : header(other.header) {
+        if (header) {
+            header->references.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    BlockSegment(BlockSegment&& other) noexcept : header(other.header) {
+        other.header = nullptr;
+    }
+
+    BlockSegment& operator=(BlockSegment other) noexcept {
+        std::swap(header, other.header);
+        return *this;
+    }
+
+    ~BlockSegment() {
+        release();
+    }
+
+    int* indices() const {
+        return reinterpret_cast<int*>(header + 1);
+    }
+};
+
+// Append-only list of block indices. The first 16 live inline, so most
+// files never allocate for their list; the rest live in shared segments that
+// never move, heap segment k holding 16 << k of them. Copying a BlockList (as
+// a checkpoint snapshot does) copies the inline part and the segment
+// pointers only. The copy keeps its own length and never sees indices
+// appended to the original later.
+struct BlockList {
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+    static constexpr size_t inlineSize = 16;
+    static constexpr size_t firstSegmentSize = 16;
+
+    int inlineBlocks[inlineSize];
+    std::pmr::vector<BlockSegment> segments;
+    size_t count = 0;
+
+    explicit BlockList(const allocator_type& alloc = {}) : segments(alloc) {}
+    BlockList(const BlockList& other, const allocator_type& alloc = {})
+        : segments(other.segments, alloc), count(other.count) {
+        std::copy(other.inlineBlocks, other.inlineBlocks + std::min(count, inlineSize), inlineBlocks);
+    }
+    BlockList(BlockList&& other) = default;
+    BlockList(BlockList&& other, const allocator_type& alloc)
+        : segments(std::move(other.segments), alloc), count(other.count) {
+        std::copy(other.inlineBlocks, other.inlineBlocks + std::min(count, inlineSize), inlineBlocks);
+    }
+    BlockList& operator=(const BlockList& other) = default;
+    BlockList& operator=(BlockList&& other) = default;
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    int operator[](size_t index) const {
+        if (index < inlineSize) {
+            return inlineBlocks[index];
+        }
+        index -= inlineSize;
+        size_t segment = 63 - __builtin_clzll(index / firstSegmentSize + 1);
+        return segments[segment].indices()[index - firstSegmentSize * ((size_t(1) << segment) - 1)];
+    }
+
+    void push_back(int blockIndex) {
+        if (count < inlineSize) {
+            inlineBlocks[count++] = blockIndex;
+            return;
+        }
+        size_t index = count - inlineSize;
+        size_t segment = segments.size();
+        if (index == firstSegmentSize * ((size_t(1) << segment) - 1)) {
+            segments.emplace_back(firstSegmentSize << segment);
+            segment++;
+        }
+        segment--;
+        segments[segment].indices()[index - firstSegmentSize * ((size_t(1) << segment) - 1)] = blockIndex;
+        count++;
+    }
+
+    struct const_iterator {
+        const BlockList* list;
+        size_t index;
+
+        int operator*() const {
+            return (*list)[index];
+        }
+
+        const_iterator& operator++() {
+            index++;
+            return *this;
+        }
+
+        bool operator!=(const const_iterator& other) const {
+            return index != other.index;
+        }
+    };
+
+    const_iterator begin() const {
+        return const_iterator{this, 0};
+    }
+
+    const_iterator end() const {
+        return const_iterator{this, count};
+    }
+};
+
+// Allocator-aware, so a File placed in FileSystem::files takes its name and
+// vectors from the file system's inode pool.
+struct File {
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    std::pmr::string name;
+    FileMetadata metadata;
+    std::pmr::vector<FileVersion> versions;
+    BlockList allocatedBlocks;              // Store allocated data blocks
+    size_t latestBlockCount = 0;            // The latest version lives in the last latestBlockCount blocks
+
+    explicit File(std::string_view n, const allocator_type& alloc = {})
+        : name(n, alloc), versions(alloc), allocatedBlocks(alloc) {}
+
+    File(File&& other) = default;
+    File(File&& other, const allocator_type& alloc)
+        : name(std::move(other.name), alloc), metadata(other.metadata), versions(std::move(other.versions), alloc),
+          allocatedBlocks(std::move(other.allocatedBlocks), alloc), latestBlockCount(other.latestBlockCount) {}
+    File& operator=(File&& other) = default;
+
+    // Takes over content's buffer; its memory resource must outlive the version
+    void addVersion(std::pmr::string content) {
+        versions.push_back(FileVersion{std::time(0), std::move(content)});
+        metadata.lastUpdated = versions.back().timestamp;
+    }
+
+    std::string_view getLatestContent() const {
+        if (!versions.empty()) {
+            return versions.back().content;
+        }
+        return "No content available.";
+    }
+};
+
+struct DataBlock {
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    std::pmr::string content;
+    uint32_t checksum = 0; // crc32c of content
+
+    explicit DataBlock(const allocator_type& alloc = {}) : content(alloc) {}
+    DataBlock(std::string_view data, uint32_t crc, const allocator_type& alloc = {})
+        : content(data, alloc), checksum(crc) {}
+
+    DataBlock(const DataBlock& other) = default;
+    DataBlock(DataBlock&& other) = default;
+    DataBlock(const DataBlock& other, const allocator_type& alloc) : content(other.content, alloc), checksum(other.checksum) {}
+    DataBlock(DataBlock&& other, const allocator_type& alloc)
+        : content(std::move(other.content), alloc), checksum(other.checksum) {}
+};
+
+// Append-only block storage. A block never changes once written, and blocks
+// live in fixed-size chunks held by shared_ptr, so copying a BlockStore (as a
+// checkpoint snapshot does) shares every payload and copies only chunk
+// pointers.
+struct BlockStore {
+    static const size_t blockSize = 128;
+    static const size_t chunkBlocks = 4096;
+
+    // A chunk is a slab: its DataBlocks and their payloads are carved out of
+    // the chunk's own arena, and all of it is freed at once by whichever
+    // thread drops the last reference. The blocks array is raw storage that
+    // append() builds each block into in place; nothing about it changes
+    // afterwards, so readers may index any block below their own count while
+    // the writer fills in later slots.
+    struct Chunk {
+        std::pmr::monotonic_buffer_resource arena;
+        DataBlock* blocks;
+        size_t constructed = 0; // writer and destructor only
+
+        Chunk()
+            : arena(chunkBlocks * (sizeof(DataBlock) + blockSize + 16)),
+              blocks(static_cast<DataBlock*>(arena.allocate(chunkBlocks * sizeof(DataBlock), alignof(DataBlock)))) {}
+
+        Chunk(const Chunk&) = delete;
+        Chunk& operator=(const Chunk&) = delete;
+
+        ~Chunk() {
+            for (size_t i = 0; i < constructed; i++) {
+                blocks[i].~DataBlock();
+            }
+        }
+    };
+
+    std::vector<std::shared_ptr<Chunk>> chunks;
+    size_t count = 0;
+
+    size_t size() const {
+        return count;
+    }
+
+    const DataBlock& operator[](size_t index) const {
+        return chunks[index / chunkBlocks]->blocks[index % chunkBlocks];
+    }
+
+    void append(std::string_view data, uint32_t checksum) {
+        if (count % chunkBlocks == 0) {
+            chunks.push_back(std::make_shared<Chunk>());
+        }
+        Chunk& chunk = *chunks.back();
+        new (chunk.blocks + chunk.constructed) DataBlock(data, checksum, &chunk.arena);
+        chunk.constructed++;
+        count++;
+    }
+
+    // Snapshots that still reference the old chunks keep them alive
+    void clear() {
+        chunks.clear();
+        count = 0;
+    }
+};
+
+struct FileSystem {
+    std::string name;
+    // Version payloads and interned names never change, so they are bump
+    // allocated and only freed all together by clear(); files and the index
+    // come from size-class pools. Declared first so they outlive their users.
+    std::pmr::monotonic_buffer_resource versionArena{1 << 20};
+    // Import readers fill version payloads on their own threads, so theirs
+    // come from a synchronized pool and are adopted without another copy.
+    std::pmr::synchronized_pool_resource importArena;
+    std::pmr::unsynchronized_pool_resource inodePool;
+    std::pmr::vector<File> files{&inodePool};
+    BlockStore dataBlocks;
+    int nextBlockIndex = 0;
+    std::pmr::unordered_map<std::string_view, size_t> fileIndex{&inodePool}; // interned name -> position in files
+    bool verbose = true;                                                     // per-file messages on std::cout
+    TraceWriter* trace = nullptr;                                            // records every operation when set
+
+    FileSystem(std::string n) : name(n) {}
+
+    // Gauges are shared by every file system in the process, so each one only
+    // ever adds and takes back its own share
+    ~FileSystem() {
+        addToGauges(-1);
+    }
+
+    // Copies a name into the version arena, where it stays put for the index
+    std::string_view internName(std::string_view fileName) {
+        char* copy = static_cast<char*>(versionArena.allocate(fileName.size() + 1, 1));
+        std::memcpy(copy, fileName.data(), fileName.size());
+        return std::string_view(copy, fileName.size());
+    }
+
+    File* findFileByName(std::string_view fileName) {
+        FS_TIME_OP(Op::FindByName);
+        auto found = fileIndex.find(fileName);
+        if (found != fileIndex.end()) {
+            return &files[found->second];
+        }
+        return nullptr;
+    }
+
+    // Must be called after files was filled or reordered directly
+    void rebuildIndex() {
+        fileIndex.clear();
+        for (size_t i = 0; i < files.size(); i++) {
+            fileIndex[internName(files[i].name)] = i;
+        }
+    }
+
+    // Drops every file, block and version payload
+    void clear() {
+        addToGauges(-1);
+        fileIndex.clear();
+        files.clear();
+        dataBlocks.clear();
+        nextBlockIndex = 0;
+        versionArena.release();
+        importArena.release();
+    }
+
+    void addOrUpdateFile(std::string_view fileName, std::string_view content) {
+        addOrUpdateFile(fileName, std::pmr::string(content, &versionArena));
+    }
+
+    // content must come from versionArena or importArena
+    void addOrUpdateFile(std::string_view fileName, std::pmr::string content) {
+        FS_TIME_OP(Op::AddOrUpdate);
+        FS_ADD_GAUGE(Gauge::Versions, 1);
+        if (trace) {
+            trace->record(TraceOp::CreateOrUpdate, fileName, content.size());
+        }
+        File* existingFile = findFileByName(fileName);
+        if (existingFile) {
+            existingFile->addVersion(std::move(content));
+            if (verbose) {
+                std::cout << "File '" << fileName << "' updated with a new version." << std::endl;
+            }
+            allocateFileBlocks(existingFile);
+            FS_COUNT(Counter::FilesUpdated, 1);
+        } else {
+            fileIndex[internName(fileName)] = files.size();
+            files.emplace_back(fileName);
+            File& newFile = files.back();
+            newFile.addVersion(std::move(content));
+            
+            // Allocate data blocks for the new file
+            allocateFileBlocks(&newFile);
+
+            FS_COUNT(Counter::FilesCreated, 1);
+            FS_ADD_GAUGE(Gauge::Files, 1);
+            if (verbose) {
+                std::cout << "File '" << fileName << "' created with the initial version." << std::endl;
+            }
+        }
+    }
+
+    void allocateFileBlocks(File* file) {
+        FS_TIME_OP(Op::AllocateBlocks);
+        std::string_view content = file->versions.back().content;
+        size_t blockSize = BlockStore::blockSize;
+        file->latestBlockCount = 0;
+        FS_COUNT(Counter::BytesWritten, content.size());
+        
+        // Allocate data blocks for the file's content
+        for (size_t offset = 0; offset < content.size(); offset += blockSize) {
+            std::string_view piece = content.substr(offset, blockSize); // Take a portion of the content
+
+            file->allocatedBlocks.push_back(nextBlockIndex);
+            file->latestBlockCount++;
+            dataBlocks.append(piece, crc32c(piece));
+            nextBlockIndex++;
+            FS_COUNT(Counter::BlocksAllocated, 1);
+        }
+        FS_ADD_GAUGE(Gauge::BlocksUsed, file->latestBlockCount);
+    }
+
+    void markFileForDeletion(const std::string& fileName) {
+        if (trace) {
+            trace->record(TraceOp::Delete, fileName);
+        }
+        File* fileToDelete = findFileByName(fileName);
+        if (fileToDelete) {
+            if (!fileToDelete->metadata.deletionMark) {
+                FS_ADD_GAUGE(Gauge::DeletionMarked, 1);
+            }
+            fileToDelete->metadata.deletionMark = true;
+            if (verbose) {
+                std::cout << "File '" << fileName << "' marked for deletion." << std::endl;
+            }
+        } else if (verbose) {
+            std::cout << "File not found: '" << fileName << "'" << std::endl;
+        }
+    }
+
+    // Adds (sign 1) or takes back (sign -1) everything this file system holds
+    void addToGauges(int64_t sign) {
+#ifndef FS_NO_STATS
+        int64_t versions = 0;
+        int64_t deletionMarked = 0;
+        for (const File& file : files) {
+            versions += file.versions.size();
+            deletionMarked += file.metadata.deletionMark;
+        }
+        FS_ADD_GAUGE(Gauge::Files, sign * static_cast<int64_t>(files.size()));
+        FS_ADD_GAUGE(Gauge::BlocksUsed, sign * static_cast<int64_t>(dataBlocks.size()));
+        FS_ADD_GAUGE(Gauge::Versions, sign * versions);
+        FS_ADD_GAUGE(Gauge::DeletionMarked, sign * deletionMarked);
+#else
+        (void)sign;
+#endif
+    }
+
+    // Counts in a file list that was filled directly after clear()
+    void refreshGauges() {
+        addToGauges(1);
+    }
+
+    void listFiles(std::ostream& out = std::cout) {
+        if (trace) {
+            trace->record(TraceOp::List);
+        }
+        out << "Files in the file system:" << std::endl;
+        for (const File& file : files) {
+            // localtime_r and a local buffer: shards list concurrently in replay
+            std::tm local;
+            char updated[64];
+            localtime_r(&file.metadata.lastUpdated, &local);
+            std::strftime(updated, sizeof(updated), "%a %b %e %H:%M:%S %Y\n", &local);
+            out << "Name: " << file.name << " | Deletion Mark: " << (file.metadata.deletionMark ? "Yes" : "No");
+            out << " | Last Updated: " << updated;
+            out << " | Latest Content: " << file.getLatestContent() << std::endl;
+        }
+    }
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include "filesystem.h"
+
+// Block checksum verification: a parallel pass used on load, and a
+// rate-limited scrubber that keeps re-reading blocks in the background.
+
+inline bool blockIsIntact(const DataBlock& block) {
+    return crc32c(block.content) == block.checksum;
+}
+
+// Checks blocks [0, blocks.size()) on every core and returns the indices
+// whose content no longer matches the stored checksum, in ascending order
+inline std::vector<size_t> verifyBlocks(const BlockStore& blocks) {
+    size_t count = blocks.size();
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min(workers, count / BlockStore::chunkBlocks + 1);
+    std::vector<std::vector<size_t>> bad(workers);
+    std::vector<std::thread> threads;
+
+    size_t perWorker = (count + workers - 1) / workers;
+    for (size_t w = 0; w < workers; w++) {
+        size_t begin = w * perWorker;
+        size_t end = std::min(count, begin + perWorker);
+        auto verifyRange = [&blocks, &bad, w, begin, end] {
+            for (size_t i = begin; i < end; i++) {
+                if (!blockIsIntact(blocks[i])) {
+                    bad[w].push_back(i);
+                }
+            }
+        };
+        if (w + 1 == workers) {
+            verifyRange();
+        } else {
+            threads.emplace_back(verifyRange);
+        }
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    std::vector<size_t> all;
+    for (const std::vector<size_t>& part : bad) {
+        all.insert(all.end(), part.begin(), part.end());
+    }
+    return all;
+}
+
+// Names the file that owns each of the given blocks
+inline void reportCorruptBlocks(const FileSystem& fs, const std::vector<size_t>& badBlocks) {
+    if (badBlocks.empty()) {
+        return;
+    }
+    std::set<size_t> bad(badBlocks.begin(), badBlocks.end());
+    for (const File& file : fs.files) {
+        for (int blockIndex : file.allocatedBlocks) {
+            if (bad.erase(blockIndex)) {
+                std::cout << "Checksum mismatch: file '" << file.name << "' block " << blockIndex << std::endl;
+            }
+        }
+    }
+    for (size_t blockIndex : bad) {
+        std::cout << "Checksum mismatch: unreferenced block " << blockIndex << std::endl;
+    }
+    FS_COUNT(Counter::ChecksumFailures, badBlocks.size());
+}
+
+// Background scrubber. The command thread hands it the current block store
+// with track(); it walks the blocks oldest first at no more than
+// bytesPerSecond and queues any mismatch for the command thread to report.
+struct Scrubber {
+    static const int slicesPerSecond = 10;
+
+    uint64_t bytesPerSecond;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+    BlockStore blocks;
+    std::vector<size_t> failures;
+    std::set<size_t> reported; // worker-only; a bad block is queued once
+    std::thread worker;
+
+    // knownBad lists blocks that were already reported, e.g. by the loader
+    Scrubber(uint64_t rate, const std::vector<size_t>& knownBad)
+        : bytesPerSecond(rate), reported(knownBad.begin(), knownBad.end()) {
+        worker = std::thread([this] { run(); });
+    }
+
+    ~Scrubber() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    // Copies only chunk pointers, so this is cheap to call after every command
+    void track(const BlockStore& store) {
+        std::lock_guard<std::mutex> guard(lock);
+        blocks = store;
+    }
+
+    std::vector<size_t> takeFailures() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<size_t> taken;
+        taken.swap(failures);
+        return taken;
+    }
+
+    void run() {
+        size_t cursor = 0;
+        uint64_t budgetPerSlice = std::max<uint64_t>(1, bytesPerSecond / slicesPerSecond);
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopping) {
+            BlockStore view = blocks;
+            guard.unlock();
+
+            std::vector<size_t> bad;
+            uint64_t scanned = 0;
+            if (cursor >= view.size()) {
+                cursor = 0;
+            }
+            while (cursor < view.size() && scanned < budgetPerSlice) {
+                if (!blockIsIntact(view[cursor]) && reported.insert(cursor).second) {
+                    bad.push_back(cursor);
+                }
+                scanned += view[cursor].content.size() + sizeof(DataBlock);
+                cursor++;
+            }
+            FS_COUNT(Counter::BytesScrubbed, scanned);
+
+            guard.lock();
+            failures.insert(failures.end(), bad.begin(), bad.end());
+            wake.wait_for(guard, std::chrono::milliseconds(1000 / slicesPerSecond), [this] { return stopping; });
+        }
+    }
+};
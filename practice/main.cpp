@@ -4,22 +4,30 @@
 #include <string>
 #include <ctime>
 #include <sstream>
+#include <cstdio>
+#include <limits>
 #include "directory.h"
 
 bool running = true;
-void backupFileSystem();
+// Only a flag is set here; the backup itself runs from main() once the menu
+// loop has noticed it
+volatile std::sig_atomic_t flushRequested = 0;
 
 void sigintHandler(int signal) {
     if (signal == SIGINT) {
-        std::cout << "Received SIGINT (Ctrl+C). Exiting the program." << std::endl;
-        backupFileSystem(); 
-        running = false; 
-        exit(0);
+        flushRequested = 1;
     }
 }
 
 Directory root("root");
 
+// A follow-up prompt's answer is usable only if the read succeeded; Ctrl+C
+// interrupts the read and leaves stale or empty input behind
+bool promptAnswered()
+{
+    return cin && !flushRequested;
+}
+
 void listFiles() {
     std::cout << "Files in the root directory:" << std::endl;
     for (const File& file : root.files) {
@@ -29,14 +37,21 @@ void listFiles() {
     }
 }
 
+// Written to a temporary file first and renamed over the backup, so an
+// interrupted backup never leaves a torn file behind
 void backupFileSystem() {
-    std::ofstream backupFile("filesystem_backup.txt");
+    std::ofstream backupFile("filesystem_backup.txt.tmp");
     for (const File& file : root.files) {
         backupFile << file.name << " " << file.metadata.deletionMark << " " << file.metadata.lastUpdated << std::endl;
         for (const FileVersion& version : file.versions) {
             backupFile << version.timestamp << " " << version.content << std::endl;
         }
     }
+    backupFile.close();
+    if (!backupFile || std::rename("filesystem_backup.txt.tmp", "filesystem_backup.txt") != 0) {
+        std::cout << "File system backup failed." << std::endl;
+        return;
+    }
     std::cout << "File system backup created." << std::endl;
 }
 
@@ -75,7 +90,7 @@ int list_functions()
 {
     string fileName;
     string fileContent;
-    while(running)
+    while(running && !flushRequested)
     {
         cout << "1. List all files " << endl;
         cout << "2. Create a new file" << endl;
@@ -87,6 +102,8 @@ int list_functions()
         int select;
         if(!(cin >> select))
         {
+            if(flushRequested || cin.eof())
+                break;
             cout << "invalid input" << endl;
             cin.clear();
             cin.ignore(numeric_limits<streamsize>::max(), '\n');
@@ -103,7 +120,8 @@ int list_functions()
         case 2:
             // cout << "2" << endl;
             cout << "Enter the file name: ";
-            cin >> fileName;
+            if(!(cin >> fileName) || !promptAnswered())
+                break;
             if(root.checkExistence(fileName))
             {
                 cout << "File already exists" << endl;
@@ -111,16 +129,19 @@ int list_functions()
             }
             cout << "Enter the file content: ";
             cin.ignore(); // Clear the newline from the buffer
-            getline(std::cin, fileContent);
+            if(!getline(std::cin, fileContent) || !promptAnswered())
+                break;
             root.addFile(fileName, fileContent);
             break;
         case 3:
             // cout << "3" << endl;
             cout << "Enter the file name: ";
-            cin >> fileName;
+            if(!(cin >> fileName) || !promptAnswered())
+                break;
             cout << "Enter the file content: ";
             cin.ignore(); // Clear the newline from the buffer
-            getline(std::cin, fileContent);
+            if(!getline(std::cin, fileContent) || !promptAnswered())
+                break;
             root.UpdateFile(fileName, fileContent);
             break;
         case 4:
@@ -128,7 +149,8 @@ int list_functions()
             break;
         case 5:
             cout << "Enter the file name to mark for deletion: ";
-            cin >> fileName;
+            if(!(cin >> fileName) || !promptAnswered())
+                break;
             root.markFileForDeletion(fileName);
             break;
         case 6:
@@ -145,7 +167,15 @@ int list_functions()
 }
 
 int main(){
-    signal(SIGINT, sigintHandler);
+    // No SA_RESTART, so a blocked read on stdin returns and the loop exits
+    struct sigaction action = {};
+    action.sa_handler = sigintHandler;
+    sigaction(SIGINT, &action, nullptr);
     loadFileSystem(); 
     list_functions();
+    if(flushRequested)
+    {
+        std::cout << std::endl << "Received SIGINT (Ctrl+C). Exiting the program." << std::endl;
+        backupFileSystem();
+    }
 }
\ No newline at end of file
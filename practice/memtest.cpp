@@ -14,11 +14,12 @@ char* readStringFromInput() {
 
     while (std::cin.get(ch)) {
         if (currentSize >= bufferSize - 1) {
-            // The current buffer is full, reallocate memory
-            bufferSize += chunkSize;
+            // The current buffer is full, double it so reading n characters
+            // costs O(n) copying in total
+            bufferSize = bufferSize ? bufferSize * 2 : chunkSize;
             char* newBuffer = new char[bufferSize];
             if (buffer) {
-                std::strcpy(newBuffer, buffer);
+                std::memcpy(newBuffer, buffer, currentSize + 1);
                 delete[] buffer;
             }
             buffer = newBuffer;
@@ -0,0 +1,469 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "checkpoint.h"
+#include "transfer.h"
+
+// Replays an operation trace against the FileSystem core, or generates a
+// synthetic one.
+//
+// Usage:
+//   replay <trace> [--threads N] [--speed recorded|max] [--checkpoint <path>]
+//   replay --generate <trace> [--ops N] [--files N] [--zipf S]
+//          [--sizes fixed:N|uniform:MIN:MAX|lognormal:MEDIAN:SIGMA]
+//          [--write-ratio W] [--delete-ratio D] [--list-every N]
+//          [--save-every N] [--rate OPS_PER_SEC] [--seed N]
+//   replay --generate-tree <dir> [--files N] [--sizes SPEC] [--seed N]
+//   replay --import <dir> [--export <dir>]
+//
+// Traces come from `a.out --trace <file>` or from --generate. With more than
+// one thread the name space is sharded by file name: every thread owns an
+// independent FileSystem and replays the operations on its names in trace
+// order; list, save and load go to every shard. Shard i checkpoints to
+// "<path>.<i>". Content is synthesized from the recorded size.
+//
+// --generate-tree writes a host directory tree (1000 files per subdirectory)
+// and --import times a bulk import of one into an empty file system, then
+// optionally an export of the result. For example, the user-029 runs:
+//   replay --generate-tree small --files 1000000 --sizes uniform:0:484
+//   replay --import small --export small.out
+//   replay --generate-tree large --files 1 --sizes fixed:1073741824
+//   replay --import large --export large.out
+
+// Every heap allocation in the process, so a replay can report how many the
+// file system made per operation
+std::atomic<uint64_t> heapAllocations(0);
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+struct WorkloadOptions {
+    uint64_t ops = 100000;
+    uint64_t files = 10000;
+    double zipf = 0.99;
+    std::string sizes = "lognormal:1024:1.5";
+    double writeRatio = 0.3;
+    double deleteRatio = 0.01;
+    uint64_t listEvery = 0;
+    uint64_t saveEvery = 0;
+    double rate = 10000;
+    uint64_t seed = 1;
+};
+
+// Draws content sizes from a "fixed:N", "uniform:MIN:MAX" or
+// "lognormal:MEDIAN:SIGMA" description
+struct SizeDistribution {
+    std::string kind;
+    double a = 0;
+    double b = 0;
+
+    bool parse(const std::string& spec) {
+        size_t colon = spec.find(':');
+        kind = spec.substr(0, colon);
+        if (colon == std::string::npos) {
+            return false;
+        }
+        char* end;
+        a = std::strtod(spec.c_str() + colon + 1, &end);
+        if (*end == ':') {
+            b = std::strtod(end + 1, &end);
+        }
+        return kind == "fixed" || kind == "uniform" || kind == "lognormal";
+    }
+
+    uint64_t draw(std::mt19937_64& rng) const {
+        if (kind == "uniform") {
+            return std::uniform_int_distribution<uint64_t>(a, std::max(a, b))(rng);
+        }
+        if (kind == "lognormal") {
+            return static_cast<uint64_t>(std::lognormal_distribution<double>(std::log(std::max(a, 1.0)), b)(rng));
+        }
+        return static_cast<uint64_t>(a);
+    }
+};
+
+// Samples ranks 0..n-1 with probability proportional to 1 / (rank + 1)^s
+struct ZipfSampler {
+    std::vector<double> cdf;
+
+    ZipfSampler(uint64_t n, double s) : cdf(std::max<uint64_t>(n, 1)) {
+        double sum = 0;
+        for (size_t rank = 0; rank < cdf.size(); rank++) {
+            sum += 1.0 / std::pow(rank + 1.0, s);
+            cdf[rank] = sum;
+        }
+        for (double& value : cdf) {
+            value /= sum;
+        }
+    }
+
+    uint64_t draw(std::mt19937_64& rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    }
+};
+
+bool generateWorkload(const WorkloadOptions& options, const std::string& path) {
+    SizeDistribution sizes;
+    if (!sizes.parse(options.sizes)) {
+        std::cout << "Invalid size distribution '" << options.sizes << "'." << std::endl;
+        return false;
+    }
+    TraceWriter trace(path);
+    if (!trace.good()) {
+        std::cout << "Cannot write trace file '" << path << "'." << std::endl;
+        return false;
+    }
+
+    std::mt19937_64 rng(options.seed);
+    ZipfSampler names(options.files, options.zipf);
+    std::exponential_distribution<double> gaps(options.rate > 0 ? options.rate : 1);
+    std::uniform_real_distribution<double> mix(0, 1);
+    double timeNs = 0;
+    for (uint64_t i = 1; i <= options.ops; i++) {
+        timeNs += options.rate > 0 ? gaps(rng) * 1e9 : 0;
+        uint64_t now = static_cast<uint64_t>(timeNs);
+        if (options.listEvery && i % options.listEvery == 0) {
+            trace.record(now, TraceOp::List, "", 0);
+            continue;
+        }
+        if (options.saveEvery && i % options.saveEvery == 0) {
+            trace.record(now, TraceOp::Save, "", 0);
+            continue;
+        }
+        std::string name = "file" + std::to_string(names.draw(rng));
+        double u = mix(rng);
+        if (u < options.deleteRatio) {
+            trace.record(now, TraceOp::Delete, name, 0);
+        } else if (u < options.deleteRatio + options.writeRatio) {
+            trace.record(now, TraceOp::CreateOrUpdate, name, sizes.draw(rng));
+        } else {
+            trace.record(now, TraceOp::Read, name, 0);
+        }
+    }
+    trace.flush();
+    std::cout << "Generated " << options.ops << " operations into '" << path << "'." << std::endl;
+    return trace.good();
+}
+
+// Writes options.files host files below dir with sizes drawn from
+// options.sizes, as input for --import
+bool generateHostTree(const WorkloadOptions& options, const std::string& dir) {
+    SizeDistribution sizes;
+    if (!sizes.parse(options.sizes)) {
+        std::cout << "Invalid size distribution '" << options.sizes << "'." << std::endl;
+        return false;
+    }
+    std::mt19937_64 rng(options.seed);
+    std::string pattern(1 << 20, 0);
+    for (size_t i = 0; i < pattern.size(); i++) {
+        pattern[i] = static_cast<char>('a' + i % 26);
+    }
+
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < options.files; i++) {
+        std::string path = dir + "/d" + std::to_string(i / 1000) + "/f" + std::to_string(i);
+        if (i % 1000 == 0) {
+            createParentDirectories(path);
+        }
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        for (uint64_t left = sizes.draw(rng); left > 0 && out;) {
+            size_t n = std::min<uint64_t>(left, pattern.size());
+            out.write(pattern.data(), n);
+            left -= n;
+            bytes += n;
+        }
+        if (!out) {
+            std::cout << "Cannot write '" << path << "'." << std::endl;
+            return false;
+        }
+    }
+    std::cout << "Generated " << options.files << " files (" << bytes / 1048576.0 << " MB) below '" << dir << "'."
+              << std::endl;
+    return true;
+}
+
+// Imports importDir into an empty file system, then exports it to exportDir
+// unless that is empty
+int transferBenchmark(const std::string& importDir, const std::string& exportDir) {
+    FileSystem fs("import");
+    fs.verbose = false;
+    printTransferResult("Imported", importHostDirectory(fs, importDir));
+    if (!exportDir.empty()) {
+        printTransferResult("Exported", exportHostDirectory(fs, exportDir));
+    }
+    return 0;
+}
+
+struct ReplayOptions {
+    size_t threads = 1;
+    bool recordedSpeed = false;
+    std::string checkpointPath = "replay_backup.txt";
+};
+
+// Per-thread results: latency histogram (ns, LatencyBuckets layout) per op
+struct ReplayResult {
+    std::vector<uint64_t> histogram[traceOpCount];
+    uint64_t calls[traceOpCount] = {};
+    uint64_t totalNs[traceOpCount] = {};
+    uint64_t bytesRead = 0; // latest-version content found by Read ops
+
+    ReplayResult() {
+        for (int op = 0; op < traceOpCount; op++) {
+            histogram[op].assign(LatencyBuckets::count, 0);
+        }
+    }
+
+    void add(int op, uint64_t ns) {
+        calls[op]++;
+        totalNs[op] += ns;
+        histogram[op][LatencyBuckets::indexFor(ns)]++;
+    }
+
+    void merge(const ReplayResult& other) {
+        bytesRead += other.bytesRead;
+        for (int op = 0; op < traceOpCount; op++) {
+            calls[op] += other.calls[op];
+            totalNs[op] += other.totalNs[op];
+            for (int i = 0; i < LatencyBuckets::count; i++) {
+                histogram[op][i] += other.histogram[op][i];
+            }
+        }
+    }
+
+    uint64_t percentile(int op, double p) const {
+        uint64_t rank = std::min<uint64_t>(static_cast<uint64_t>(p / 100.0 * calls[op]), calls[op] - 1);
+        uint64_t seen = 0;
+        for (int i = 0; i < LatencyBuckets::count; i++) {
+            seen += histogram[op][i];
+            if (seen > rank) {
+                return LatencyBuckets::upperBound(i);
+            }
+        }
+        return 0;
+    }
+};
+
+void replayShard(const std::vector<const TraceRecord*>& records, const ReplayOptions& options,
+                 const std::string& checkpointPath, std::chrono::steady_clock::time_point start,
+                 ReplayResult& result) {
+    FileSystem fs("replay");
+    fs.verbose = false;
+    Checkpointer checkpointer(checkpointPath);
+    std::ostream discard(nullptr);
+    uint64_t lastSave = 0; // ticket of the newest Save, which a Load must see
+    std::string content; // reused so the harness itself does not allocate per operation
+
+    for (const TraceRecord* record : records) {
+        if (record->op == TraceOp::CreateOrUpdate) {
+            content.assign(record->size, static_cast<char>('a' + std::hash<std::string>()(record->name) % 26));
+        }
+        if (options.recordedSpeed) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(record->timeNs));
+        }
+
+        auto opStart = std::chrono::steady_clock::now();
+        switch (record->op) {
+            case TraceOp::CreateOrUpdate:
+                fs.addOrUpdateFile(record->name, content);
+                break;
+            case TraceOp::Delete:
+                fs.markFileForDeletion(record->name);
+                break;
+            case TraceOp::List:
+                fs.listFiles(discard);
+                break;
+            case TraceOp::Save:
+                lastSave = checkpointer.request(takeSnapshot(fs));
+                break;
+            case TraceOp::Load:
+                // Saves are written in the background; without the wait a Load
+                // would read whichever checkpoint happens to be on disk
+                if (lastSave) {
+                    checkpointer.waitFor(lastSave);
+                }
+                loadCheckpoint(fs, checkpointPath);
+                break;
+            case TraceOp::Read:
+                if (File* file = fs.findFileByName(record->name)) {
+                    result.bytesRead += file->versions.empty() ? 0 : file->versions.back().content.size();
+                }
+                break;
+            default:
+                break;
+        }
+        auto elapsed = std::chrono::steady_clock::now() - opStart;
+        result.add(static_cast<int>(record->op), std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+}
+
+int replay(const std::string& tracePath, const ReplayOptions& options) {
+    std::vector<TraceRecord> records;
+    if (!readTrace(tracePath, records)) {
+        std::cout << "Cannot read trace file '" << tracePath << "'." << std::endl;
+        return 1;
+    }
+
+    std::vector<std::vector<const TraceRecord*>> shards(options.threads);
+    for (const TraceRecord& record : records) {
+        if (record.name.empty()) {
+            for (std::vector<const TraceRecord*>& shard : shards) {
+                shard.push_back(&record);
+            }
+        } else {
+            shards[std::hash<std::string>()(record.name) % options.threads].push_back(&record);
+        }
+    }
+
+    std::vector<ReplayResult> results(options.threads);
+    std::vector<std::thread> threads;
+    threads.reserve(options.threads);
+    uint64_t allocationsBefore = heapAllocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < options.threads; t++) {
+        std::string path = options.threads > 1 ? options.checkpointPath + "." + std::to_string(t) : options.checkpointPath;
+        threads.emplace_back(replayShard, std::cref(shards[t]), std::cref(options), path, start, std::ref(results[t]));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t allocations = heapAllocations.load() - allocationsBefore;
+
+    ReplayResult total;
+    uint64_t ops = 0;
+    for (const ReplayResult& result : results) {
+        total.merge(result);
+    }
+    for (int op = 0; op < traceOpCount; op++) {
+        ops += total.calls[op];
+    }
+
+    std::cout << "Replayed " << records.size() << " records (" << ops << " operations on " << options.threads
+              << " thread(s)) in " << seconds << " s: " << ops / seconds << " ops/s" << std::endl;
+    std::cout << "Heap allocations: " << allocations << " (" << (ops ? static_cast<double>(allocations) / ops : 0)
+              << " per operation)" << std::endl;
+    if (total.calls[static_cast<int>(TraceOp::Read)] > 0) {
+        std::cout << "Read " << total.bytesRead << " bytes of latest content." << std::endl;
+    }
+    std::cout << "Latency (ns):" << std::endl;
+    for (int op = 0; op < traceOpCount; op++) {
+        if (total.calls[op] == 0) {
+            continue;
+        }
+        std::cout << "  " << traceOpName(op) << ": calls=" << total.calls[op]
+                  << " mean=" << total.totalNs[op] / total.calls[op]
+                  << " p50=" << total.percentile(op, 50)
+                  << " p90=" << total.percentile(op, 90)
+                  << " p99=" << total.percentile(op, 99)
+                  << " p999=" << total.percentile(op, 99.9)
+                  << " max=" << total.percentile(op, 100) << std::endl;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: replay <trace> [--threads N] [--speed recorded|max] [--checkpoint <path>]" << std::endl;
+        std::cout << "       replay --generate <trace> [--ops N] [--files N] [--zipf S] [--sizes SPEC]" << std::endl;
+        std::cout << "              [--write-ratio W] [--delete-ratio D] [--list-every N] [--save-every N]" << std::endl;
+        std::cout << "              [--rate OPS_PER_SEC] [--seed N]" << std::endl;
+        std::cout << "       replay --generate-tree <dir> [--files N] [--sizes SPEC] [--seed N]" << std::endl;
+        std::cout << "       replay --import <dir> [--export <dir>]" << std::endl;
+        return 1;
+    }
+
+    WorkloadOptions workload;
+    ReplayOptions replayOptions;
+    std::string generatePath;
+    std::string treePath;
+    std::string importPath;
+    std::string exportPath;
+    std::string tracePath;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg.compare(0, 2, "--") != 0) {
+            tracePath = arg;
+            continue;
+        }
+        if (!value) {
+            std::cout << "Missing value for " << arg << std::endl;
+            return 1;
+        }
+        i++;
+        if (arg == "--generate") {
+            generatePath = value;
+        } else if (arg == "--generate-tree") {
+            treePath = value;
+        } else if (arg == "--import") {
+            importPath = value;
+        } else if (arg == "--export") {
+            exportPath = value;
+        } else if (arg == "--threads") {
+            replayOptions.threads = std::max(1, std::atoi(value));
+        } else if (arg == "--speed") {
+            replayOptions.recordedSpeed = std::strcmp(value, "recorded") == 0;
+        } else if (arg == "--checkpoint") {
+            replayOptions.checkpointPath = value;
+        } else if (arg == "--ops") {
+            workload.ops = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--files") {
+            workload.files = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--zipf") {
+            workload.zipf = std::atof(value);
+        } else if (arg == "--sizes") {
+            workload.sizes = value;
+        } else if (arg == "--write-ratio") {
+            workload.writeRatio = std::atof(value);
+        } else if (arg == "--delete-ratio") {
+            workload.deleteRatio = std::atof(value);
+        } else if (arg == "--list-every") {
+            workload.listEvery = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--save-every") {
+            workload.saveEvery = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--rate") {
+            workload.rate = std::atof(value);
+        } else if (arg == "--seed") {
+            workload.seed = std::strtoull(value, nullptr, 10);
+        } else {
+            std::cout << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if (!generatePath.empty()) {
+        return generateWorkload(workload, generatePath) ? 0 : 1;
+    }
+    if (!treePath.empty()) {
+        return generateHostTree(workload, treePath) ? 0 : 1;
+    }
+    if (!importPath.empty()) {
+        return transferBenchmark(importPath, exportPath);
+    }
+    return replay(tracePath, replayOptions);
+}
@@ -0,0 +1,406 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Operation statistics for the file system core.
+//
+// Every thread records into its own ThreadStats block (single writer, relaxed
+// atomics, no locks on the hot path); collectStats() merges all blocks on
+// demand. Build with -DFS_NO_STATS to compile the instrumentation out.
+//
+// Latencies are recorded in raw clock ticks (the TSC on x86) and converted to
+// nanoseconds only when a snapshot is taken, which keeps a timed operation's
+// overhead to two counter reads and three stores. Where reading the counter
+// is slow (rdtsc is often trapped or emulated under virtualization), only one
+// operation in sampleEvery is timed; calls are still counted exactly.
+// statsbench.cpp measures the overhead on the current host.
+
+enum class Op { AddOrUpdate, AllocateBlocks, FindByName, Save, Load, CheckpointWrite, Import, Export, Count };
+enum class Counter { FilesCreated, FilesUpdated, BlocksAllocated, BytesWritten, CheckpointBytes, ChecksumFailures, BytesScrubbed, Count };
+enum class Gauge { Files, BlocksUsed, Versions, DeletionMarked, Count };
+
+const int opCount = static_cast<int>(Op::Count);
+const int counterCount = static_cast<int>(Counter::Count);
+const int gaugeCount = static_cast<int>(Gauge::Count);
+
+inline const char* opName(int op) {
+    static const char* names[] = {"addOrUpdateFile", "allocateFileBlocks", "findFileByName", "save", "load", "checkpointWrite", "import", "export"};
+    return names[op];
+}
+
+inline const char* counterName(int counter) {
+    static const char* names[] = {"files_created", "files_updated", "blocks_allocated", "bytes_written", "checkpoint_bytes", "checksum_failures", "bytes_scrubbed"};
+    return names[counter];
+}
+
+inline const char* gaugeName(int gauge) {
+    static const char* names[] = {"files", "blocks_used", "versions", "deletion_marked"};
+    return names[gauge];
+}
+
+// HDR-style log-linear buckets: values below 16 ticks are exact, every power of
+// two above that is split into 16 sub-buckets (about 6% relative error).
+struct LatencyBuckets {
+    static const int subBits = 4;
+    static const int subCount = 1 << subBits;
+    static const int count = (64 - subBits + 1) * subCount;
+
+    static int indexFor(uint64_t value) {
+        if (value < subCount) {
+            return static_cast<int>(value);
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - subBits;
+        return (shift + 1) * subCount + static_cast<int>((value >> shift) - subCount);
+    }
+
+    // Largest value that falls into the given bucket
+    static uint64_t upperBound(int index) {
+        if (index < subCount) {
+            return index;
+        }
+        int shift = index / subCount - 1;
+        uint64_t sub = subCount + index % subCount;
+        return ((sub + 1) << shift) - 1;
+    }
+};
+
+inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Tick/time pair taken at startup; the tick rate is measured against it lazily
+struct TickCalibration {
+    static const int costSamples = 1000;
+    static constexpr double slowReadNs = 10;
+
+    uint64_t startTicks = readTicks();
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    double readCostNs = measureReadCost();
+
+    static double measureReadCost() {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t sink = 0;
+        for (int i = 0; i < costSamples; i++) {
+            sink += readTicks();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        asm volatile("" : : "r"(sink));
+        return std::chrono::duration<double, std::nano>(elapsed).count() / costSamples;
+    }
+
+    // A timed operation costs about two reads; keep that well below 50 ns
+    uint32_t sampleEvery() const {
+        return readCostNs > slowReadNs ? 16 : 1;
+    }
+
+    double nsPerTick() const {
+        auto elapsed = std::chrono::steady_clock::now() - startTime;
+        while (elapsed < std::chrono::milliseconds(1)) {
+            elapsed = std::chrono::steady_clock::now() - startTime;
+        }
+        uint64_t ticks = readTicks() - startTicks;
+        double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        return ticks > 0 ? ns / ticks : 1.0;
+    }
+};
+
+inline TickCalibration& tickCalibration() {
+    static TickCalibration calibration;
+    return calibration;
+}
+
+struct ThreadStats {
+    std::atomic<uint64_t> opCalls[opCount];
+    std::atomic<uint64_t> opTimed[opCount]; // calls that were timed into opTotalTicks and opHistogram
+    std::atomic<uint64_t> opTotalTicks[opCount];
+    std::atomic<uint64_t> opHistogram[opCount][LatencyBuckets::count];
+    std::atomic<uint64_t> counters[counterCount];
+    uint32_t sampleEvery;
+    uint32_t untilSample[opCount]; // owner thread only
+
+    explicit ThreadStats(uint32_t every) : sampleEvery(every) {
+        for (int op = 0; op < opCount; op++) {
+            opCalls[op].store(0, std::memory_order_relaxed);
+            opTimed[op].store(0, std::memory_order_relaxed);
+            untilSample[op] = 1;
+            opTotalTicks[op].store(0, std::memory_order_relaxed);
+            for (int i = 0; i < LatencyBuckets::count; i++) {
+                opHistogram[op][i].store(0, std::memory_order_relaxed);
+            }
+        }
+        for (int c = 0; c < counterCount; c++) {
+            counters[c].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Only the owning thread writes, so a plain load/store pair is enough and
+    // avoids a locked read-modify-write.
+    static void bump(std::atomic<uint64_t>& slot, uint64_t n) {
+        slot.store(slot.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // True when the next call of op should be timed; the first one always is
+    bool sampleNext(Op op) {
+        uint32_t& left = untilSample[static_cast<int>(op)];
+        if (--left > 0) {
+            return false;
+        }
+        left = sampleEvery;
+        return true;
+    }
+};
+
+struct StatsRegistry {
+    std::mutex lock;
+    std::vector<std::unique_ptr<ThreadStats>> threads; // kept after thread exit so totals never go backwards
+    std::atomic<int64_t> gauges[gaugeCount];
+
+    StatsRegistry() {
+        for (int g = 0; g < gaugeCount; g++) {
+            gauges[g].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    ThreadStats* attach() {
+        uint32_t sampleEvery = tickCalibration().sampleEvery();
+        std::lock_guard<std::mutex> guard(lock);
+        threads.emplace_back(new ThreadStats(sampleEvery));
+        return threads.back().get();
+    }
+};
+
+inline StatsRegistry& statsRegistry() {
+    static StatsRegistry registry;
+    return registry;
+}
+
+// Constant-initialized, so reaching it costs no thread_local init guard
+inline ThreadStats& localStats() {
+    thread_local ThreadStats* stats = nullptr;
+    if (__builtin_expect(!stats, 0)) {
+        stats = statsRegistry().attach();
+    }
+    return *stats;
+}
+
+inline void recordLatency(ThreadStats& stats, Op op, uint64_t ticks) {
+    int o = static_cast<int>(op);
+    ThreadStats::bump(stats.opCalls[o], 1);
+    ThreadStats::bump(stats.opTimed[o], 1);
+    ThreadStats::bump(stats.opTotalTicks[o], ticks);
+    ThreadStats::bump(stats.opHistogram[o][LatencyBuckets::indexFor(ticks)], 1);
+}
+
+inline void recordLatency(Op op, uint64_t ticks) {
+    recordLatency(localStats(), op, ticks);
+}
+
+inline void addCounter(Counter counter, uint64_t n) {
+    ThreadStats::bump(localStats().counters[static_cast<int>(counter)], n);
+}
+
+inline void setGauge(Gauge gauge, int64_t value) {
+    statsRegistry().gauges[static_cast<int>(gauge)].store(value, std::memory_order_relaxed);
+}
+
+inline void addGauge(Gauge gauge, int64_t delta) {
+    statsRegistry().gauges[static_cast<int>(gauge)].fetch_add(delta, std::memory_order_relaxed);
+}
+
+struct ScopedOpTimer {
+    ThreadStats& stats;
+    Op op;
+    bool timed;
+    uint64_t start = 0;
+
+    explicit ScopedOpTimer(Op o) : stats(localStats()), op(o), timed(stats.sampleNext(o)) {
+        if (timed) {
+            start = readTicks();
+        }
+    }
+
+    ~ScopedOpTimer() {
+        if (timed) {
+            recordLatency(stats, op, readTicks() - start);
+        } else {
+            ThreadStats::bump(stats.opCalls[static_cast<int>(op)], 1);
+        }
+    }
+};
+
+#ifdef FS_NO_STATS
+#define FS_TIME_OP(op) ((void)0)
+#define FS_COUNT(counter, n) ((void)0)
+#define FS_SET_GAUGE(gauge, value) ((void)0)
+#define FS_ADD_GAUGE(gauge, delta) ((void)0)
+#else
+#define FS_TIME_OP(op) ScopedOpTimer opTimer_(op)
+#define FS_COUNT(counter, n) addCounter(counter, n)
+#define FS_SET_GAUGE(gauge, value) setGauge(gauge, value)
+#define FS_ADD_GAUGE(gauge, delta) addGauge(gauge, delta)
+#endif
+
+// Merged view over all threads
+struct StatsSnapshot {
+    uint64_t opCalls[opCount] = {};
+    uint64_t opTimed[opCount] = {};
+    uint64_t opTotalTicks[opCount] = {};
+    std::vector<uint64_t> opHistogram[opCount];
+    uint64_t counters[counterCount] = {};
+    int64_t gauges[gaugeCount] = {};
+    double nsPerTick = 1.0;
+
+    // Estimated from the timed calls when only a sample was timed
+    uint64_t totalNs(int op) const {
+        if (opTimed[op] == 0) {
+            return 0;
+        }
+        return static_cast<uint64_t>(opTotalTicks[op] * nsPerTick * opCalls[op] / opTimed[op]);
+    }
+
+    // Latency (ns) at the given percentile, reported as the bucket's upper bound
+    uint64_t percentile(int op, double p) const {
+        if (opTimed[op] == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p / 100.0 * opTimed[op]);
+        if (rank >= opTimed[op]) {
+            rank = opTimed[op] - 1;
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < LatencyBuckets::count; i++) {
+            seen += opHistogram[op][i];
+            if (seen > rank) {
+                return static_cast<uint64_t>(LatencyBuckets::upperBound(i) * nsPerTick);
+            }
+        }
+        return 0;
+    }
+};
+
+inline StatsSnapshot collectStats() {
+    StatsSnapshot snapshot;
+    snapshot.nsPerTick = tickCalibration().nsPerTick();
+    for (int op = 0; op < opCount; op++) {
+        snapshot.opHistogram[op].assign(LatencyBuckets::count, 0);
+    }
+    StatsRegistry& registry = statsRegistry();
+    {
+        std::lock_guard<std::mutex> guard(registry.lock);
+        for (const auto& stats : registry.threads) {
+            for (int op = 0; op < opCount; op++) {
+                snapshot.opCalls[op] += stats->opCalls[op].load(std::memory_order_relaxed);
+                snapshot.opTimed[op] += stats->opTimed[op].load(std::memory_order_relaxed);
+                snapshot.opTotalTicks[op] += stats->opTotalTicks[op].load(std::memory_order_relaxed);
+                for (int i = 0; i < LatencyBuckets::count; i++) {
+                    snapshot.opHistogram[op][i] += stats->opHistogram[op][i].load(std::memory_order_relaxed);
+                }
+            }
+            for (int c = 0; c < counterCount; c++) {
+                snapshot.counters[c] += stats->counters[c].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    for (int g = 0; g < gaugeCount; g++) {
+        snapshot.gauges[g] = registry.gauges[g].load(std::memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+inline void printStats(std::ostream& out, const StatsSnapshot& snapshot) {
+    out << "Operation latencies (ns):" << std::endl;
+    for (int op = 0; op < opCount; op++) {
+        uint64_t calls = snapshot.opCalls[op];
+        out << "  " << opName(op) << ": calls=" << calls;
+        if (calls > 0) {
+            out << " mean=" << snapshot.totalNs(op) / calls
+                << " p50=" << snapshot.percentile(op, 50)
+                << " p99=" << snapshot.percentile(op, 99)
+                << " max=" << snapshot.percentile(op, 100);
+        }
+        out << std::endl;
+    }
+    out << "Counters:";
+    for (int c = 0; c < counterCount; c++) {
+        out << " " << counterName(c) << "=" << snapshot.counters[c];
+    }
+    out << std::endl << "Gauges:";
+    for (int g = 0; g < gaugeCount; g++) {
+        out << " " << gaugeName(g) << "=" << snapshot.gauges[g];
+    }
+    out << std::endl;
+}
+
+// One JSON object per line, for the periodic dump
+inline void writeStatsJson(std::ostream& out, const StatsSnapshot& snapshot) {
+    out << "{\"time\":" << std::time(0) << ",\"ops\":{";
+    for (int op = 0; op < opCount; op++) {
+        out << (op ? "," : "") << "\"" << opName(op) << "\":{\"calls\":" << snapshot.opCalls[op]
+            << ",\"total_ns\":" << snapshot.totalNs(op)
+            << ",\"p50\":" << snapshot.percentile(op, 50)
+            << ",\"p90\":" << snapshot.percentile(op, 90)
+            << ",\"p99\":" << snapshot.percentile(op, 99)
+            << ",\"p999\":" << snapshot.percentile(op, 99.9)
+            << ",\"max\":" << snapshot.percentile(op, 100) << "}";
+    }
+    out << "},\"counters\":{";
+    for (int c = 0; c < counterCount; c++) {
+        out << (c ? "," : "") << "\"" << counterName(c) << "\":" << snapshot.counters[c];
+    }
+    out << "},\"gauges\":{";
+    for (int g = 0; g < gaugeCount; g++) {
+        out << (g ? "," : "") << "\"" << gaugeName(g) << "\":" << snapshot.gauges[g];
+    }
+    out << "}}" << std::endl;
+}
+
+// Appends a JSON stats line to a file every `intervalSeconds` until stopped
+struct StatsDumper {
+    std::string path;
+    int intervalSeconds;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread worker;
+
+    StatsDumper(std::string p, int interval) : path(p), intervalSeconds(interval) {
+        worker = std::thread([this] { run(); });
+    }
+
+    ~StatsDumper() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopping) {
+            wake.wait_for(guard, std::chrono::seconds(intervalSeconds), [this] { return stopping; });
+            std::ofstream out(path, std::ios::app);
+            writeStatsJson(out, collectStats());
+        }
+    }
+};
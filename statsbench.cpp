@@ -0,0 +1,45 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include "stats.h"
+
+// Measures what the statistics instrumentation adds to one operation.
+//
+// Usage: statsbench [iterations]
+//
+// Build twice and compare:
+//   g++ -std=c++17 -O2 -pthread statsbench.cpp -o statsbench
+//   g++ -std=c++17 -O2 -pthread -DFS_NO_STATS statsbench.cpp -o statsbench-nostats
+
+// Runs body iterations times and returns the mean cost of one run in ns
+template <typename Body>
+double nsPerIteration(uint64_t iterations, Body body) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++) {
+        body();
+        asm volatile("" ::: "memory"); // keep the loop from being folded away
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 20000000;
+
+    double empty = nsPerIteration(iterations, [] {});
+    double timedOp = nsPerIteration(iterations, [] { FS_TIME_OP(Op::FindByName); });
+    double counter = nsPerIteration(iterations, [] { FS_COUNT(Counter::BytesWritten, 1); });
+    volatile uint64_t sink = 0;
+    double tickRead = nsPerIteration(iterations, [&sink] { sink = readTicks(); });
+
+    std::cout << "empty loop:     " << empty << " ns/iteration" << std::endl;
+    std::cout << "FS_TIME_OP:     " << timedOp - empty << " ns/op" << std::endl;
+    std::cout << "FS_COUNT:       " << counter - empty << " ns/op" << std::endl;
+    std::cout << "readTicks():    " << tickRead - empty << " ns/read" << std::endl;
+#ifdef FS_NO_STATS
+    std::cout << "(statistics compiled out)" << std::endl;
+#else
+    std::cout << "timing 1 in " << localStats().sampleEvery << " operations" << std::endl;
+#endif
+    return 0;
+}
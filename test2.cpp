@@ -5,185 +5,159 @@
 #include <ctime>
 #include <sstream>
 #include <map>
+#include <limits>
+#include <csignal>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include "checkpoint.h"
+#include "transfer.h"
 
-struct FileMetadata {
-    bool deletionMark = false;
-    std::time_t lastUpdated = std::time(0);
-};
-
-struct FileVersion {
-    std::time_t timestamp;
-    std::string content;
-};
-
-struct File {
-    std::string name;
-    FileMetadata metadata;
-    std::vector<FileVersion> versions;
-    std::vector<int> allocatedBlocks;  // Store allocated data blocks
-
-    File(std::string n) : name(n) {}
-
-    void addVersion(const std::string& content) {
-        FileVersion version;
-        version.timestamp = std::time(0);
-        version.content = content;
-        versions.push_back(version);
-        metadata.lastUpdated = version.timestamp;
-    }
-
-    std::string getLatestContent() const {
-        if (!versions.empty()) {
-            return versions.back().content;
-        }
-        return "No content available.";
-    }
-};
+const char* backupPath = "filesystem_backup.txt";
 
-struct DataBlock {
-    std::string content;
+FileSystem fileSystem("root");
+Checkpointer checkpointer(backupPath);
 
-    DataBlock() : content("") {}
-};
+// Set by SIGINT; the menu loop notices it and performs the final flush
+volatile std::sig_atomic_t flushRequested = 0;
 
-struct FileSystem {
-    std::string name;
-    std::vector<File> files;
-    std::vector<DataBlock> dataBlocks;
-    int nextBlockIndex = 0;
+void sigintHandler(int) {
+    flushRequested = 1;
+}
 
-    FileSystem(std::string n) : name(n) {}
+// A follow-up prompt's answer is usable only if the read succeeded; Ctrl+C
+// interrupts the read (no SA_RESTART) and leaves stale or empty input behind
+bool promptAnswered() {
+    return std::cin && !flushRequested;
+}
 
-    File* findFileByName(const std::string& fileName) {
-        for (File& file : files) {
-            if (file.name == fileName) {
-                return &file;
-            }
-        }
-        return nullptr;
-    }
-
-    void addOrUpdateFile(const std::string& fileName, const std::string& content) {
-        File* existingFile = findFileByName(fileName);
-        if (existingFile) {
-            existingFile->addVersion(content);
-            std::cout << "File '" << fileName << "' updated with a new version." << std::endl;
-            allocateFileBlocks(existingFile);
-        } else {
-            File newFile(fileName);
-            newFile.addVersion(content);
-            
-            // Allocate data blocks for the new file
-            allocateFileBlocks(&newFile);
-
-            files.push_back(newFile);
-            std::cout << "File '" << fileName << "' created with the initial version." << std::endl;
-        }
+// Snapshots the file system and hands it to the background checkpoint thread
+uint64_t saveFileSystemState() {
+    FS_TIME_OP(Op::Save);
+    uint64_t ticket = checkpointer.request(takeSnapshot(fileSystem));
+    if (fileSystem.trace) {
+        fileSystem.trace->flush();
     }
+    std::cout << "Saving file system state to '" << backupPath << "' in the background." << std::endl;
+    return ticket;
+}
 
-    void allocateFileBlocks(File* file) {
-        std::string content = file->getLatestContent();
-        int blockSize = 128;
-        
-        // Allocate data blocks for the file's content
-        while (content.size() > 0) {
-            DataBlock block;
-            block.content = content.substr(0, blockSize); // Take a portion of the content
-
-            file->allocatedBlocks.push_back(nextBlockIndex);
-            dataBlocks.push_back(block);
-            nextBlockIndex++;
-
-            // Remove the portion that has been allocated
-            content = content.substr(blockSize);
-        }
-    }
+void showStats() {
+#ifdef FS_NO_STATS
+    std::cout << "Statistics were compiled out (FS_NO_STATS)." << std::endl;
+#else
+    printStats(std::cout, collectStats());
+#endif
+}
 
-    void markFileForDeletion(const std::string& fileName) {
-        File* fileToDelete = findFileByName(fileName);
-        if (fileToDelete) {
-            fileToDelete->metadata.deletionMark = true;
-            std::cout << "File '" << fileName << "' marked for deletion." << std::endl;
-        } else {
-            std::cout << "File not found: '" << fileName << "'" << std::endl;
-        }
+// Returns false when a damaged backup could not be set aside
+bool loadFileSystemState(std::vector<size_t>& corruptBlocks) {
+    LoadResult result = loadCheckpoint(fileSystem, backupPath, &corruptBlocks);
+    if (result == LoadResult::Missing) {
+        std::cout << "No backup file found. Starting with an empty file system." << std::endl;
+        return true;
     }
-
-    void listFiles() {
-        std::cout << "Files in the file system:" << std::endl;
-        for (const File& file : files) {
-            std::cout << "Name: " << file.name << " | Deletion Mark: " << (file.metadata.deletionMark ? "Yes" : "No");
-            std::cout << " | Last Updated: " << std::asctime(std::localtime(&file.metadata.lastUpdated));
-            std::cout << " | Latest Content: " << file.getLatestContent() << std::endl;
+    if (result == LoadResult::Damaged) {
+        // The next checkpoint would replace the backup with what was
+        // recovered, so keep the original (and any kept earlier) for manual
+        // recovery
+        std::string corruptPath = std::string(backupPath) + ".corrupt";
+        for (int n = 1; std::ifstream(corruptPath); n++) {
+            corruptPath = std::string(backupPath) + ".corrupt." + std::to_string(n);
         }
-    }
-};
-
-FileSystem fileSystem("root");
-
-void saveFileSystemState() {
-    std::ofstream backupFile("filesystem_backup.txt");
-    for (const File& file : fileSystem.files) {
-        backupFile << file.name << " " << file.metadata.deletionMark << " " << file.metadata.lastUpdated << std::endl;
-        for (int blockIndex : file.allocatedBlocks) {
-            backupFile << blockIndex << " ";
+        if (std::rename(backupPath, corruptPath.c_str()) != 0) {
+            std::cout << "Backup '" << backupPath << "' is damaged and cannot be moved to '" << corruptPath
+                      << "': " << std::strerror(errno) << ". Not starting, so it is not overwritten." << std::endl;
+            return false;
         }
-        backupFile << std::endl;
+        std::cout << "Backup '" << backupPath << "' is damaged; kept it as '" << corruptPath
+                  << "' and loaded what could be recovered." << std::endl;
+        return true;
     }
-    std::cout << "File system state saved to 'filesystem_backup.txt'." << std::endl;
+    std::cout << "File system state loaded from '" << backupPath << "'." << std::endl;
+    return true;
 }
 
-void loadFileSystemState() {
-    std::ifstream backupFile("filesystem_backup.txt");
-    if (!backupFile) {
-        std::cout << "No backup file found. Starting with an empty file system." << std::endl;
-        return;
+int exitWithFinalFlush() {
+    std::cout << "Exiting the program." << std::endl;
+    if (!checkpointer.waitFor(saveFileSystemState())) {
+        std::cout << "Failed to save the file system state to '" << backupPath << "'." << std::endl;
+        return 1;
     }
+    std::cout << "File system state saved to '" << backupPath << "'." << std::endl;
+    return 0;
+}
 
-    fileSystem.files.clear();
-    fileSystem.dataBlocks.clear();
-    fileSystem.nextBlockIndex = 0;
-
-    std::string line;
-    File currentFile("");
-    bool readingBlocks = false;
-
-    while (std::getline(backupFile, line)) {
-        std::istringstream iss(line);
-        if (!readingBlocks) {
-            if (iss >> currentFile.name >> currentFile.metadata.deletionMark >> currentFile.metadata.lastUpdated) {
-                readingBlocks = true;
-            }
-        } else {
-            int blockIndex;
-            while (iss >> blockIndex) {
-                currentFile.allocatedBlocks.push_back(blockIndex);
+// Usage: a.out [--stats-dump <file> [interval-seconds]] [--scrub-rate <MB/s>]
+//              [--trace <file>]
+// A scrub rate of 0 turns the background scrubber off. --trace records every
+// operation for later replay with replay.cpp.
+int main(int argc, char* argv[]) {
+    std::unique_ptr<StatsDumper> statsDumper;
+    std::unique_ptr<Scrubber> scrubber;
+    std::unique_ptr<TraceWriter> trace;
+    int scrubRate = 32;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--stats-dump") == 0 && i + 1 < argc) {
+            const char* path = argv[++i];
+            int interval = i + 1 < argc && std::isdigit(argv[i + 1][0]) ? std::atoi(argv[++i]) : 10;
+#ifndef FS_NO_STATS
+            statsDumper.reset(new StatsDumper(path, interval > 0 ? interval : 10));
+#else
+            (void)path;
+            (void)interval;
+#endif
+        } else if (std::strcmp(argv[i], "--scrub-rate") == 0 && i + 1 < argc) {
+            scrubRate = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace.reset(new TraceWriter(argv[++i]));
+            if (!trace->good()) {
+                std::cout << "Cannot write trace file '" << argv[i] << "'." << std::endl;
+                return 1;
             }
-            fileSystem.files.push_back(currentFile);
-            currentFile = File("");
-            readingBlocks = false;
+            fileSystem.trace = trace.get();
         }
     }
-    std::cout << "File system state loaded from 'filesystem_backup.txt'." << std::endl;
-}
 
-int main() {
-    loadFileSystemState();
+    // No SA_RESTART, so a pending read on stdin is interrupted and the loop
+    // gets to see the flag
+    struct sigaction action = {};
+    action.sa_handler = sigintHandler;
+    sigaction(SIGINT, &action, nullptr);
+
+    std::vector<size_t> corruptBlocks;
+    if (!loadFileSystemState(corruptBlocks)) {
+        return 1;
+    }
+    if (scrubRate > 0) {
+        scrubber.reset(new Scrubber(static_cast<uint64_t>(scrubRate) << 20, corruptBlocks));
+    }
 
     int choice;
     std::string fileName;
     std::string fileContent;
 
-    while (true) {
+    while (!flushRequested) {
+        if (scrubber) {
+            scrubber->track(fileSystem.dataBlocks);
+            reportCorruptBlocks(fileSystem, scrubber->takeFailures());
+        }
         std::cout << "Basic File System Menu:" << std::endl;
         std::cout << "1. List Files" << std::endl;
         std::cout << "2. Create/Update File" << std::endl;
         std::cout << "3. Mark File for Deletion" << std::endl;
         std::cout << "4. Save File System State" << std::endl;
-        std::cout << "5. Exit" << std::endl;
-        std::cout << "Enter your choice (1, 2, 3, 4, or 5): ";
+        std::cout << "5. Show Statistics" << std::endl;
+        std::cout << "6. Import Host Directory" << std::endl;
+        std::cout << "7. Export to Host Directory" << std::endl;
+        std::cout << "8. Exit" << std::endl;
+        std::cout << "Enter your choice (1-8): ";
 
         if (!(std::cin >> choice)) {
+            if (flushRequested || std::cin.eof()) {
+                break;
+            }
             std::cout << "Invalid input. Please enter a valid choice." << std::endl;
             std::cin.clear();
             std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
@@ -196,29 +170,53 @@ int main() {
                 break;
             case 2:
                 std::cout << "Enter the file name: ";
-                std::cin >> fileName;
+                if (!(std::cin >> fileName) || !promptAnswered()) {
+                    break;
+                }
                 std::cout << "Enter the file content: ";
                 std::cin.ignore();
-                std::getline(std::cin, fileContent);
+                if (!std::getline(std::cin, fileContent) || !promptAnswered()) {
+                    break;
+                }
                 fileSystem.addOrUpdateFile(fileName, fileContent);
                 break;
             case 3:
                 std::cout << "Enter the file name to mark for deletion: ";
-                std::cin >> fileName;
+                if (!(std::cin >> fileName) || !promptAnswered()) {
+                    break;
+                }
                 fileSystem.markFileForDeletion(fileName);
                 break;
             case 4:
                 saveFileSystemState();
                 break;
             case 5:
-                std::cout << "Exiting the program." << std::endl;
-                saveFileSystemState();
-                return 0;
+                showStats();
+                break;
+            case 6:
+                std::cout << "Enter the host directory to import: ";
+                if (!(std::cin >> fileName) || !promptAnswered()) {
+                    break;
+                }
+                printTransferResult("Imported", importHostDirectory(fileSystem, fileName));
+                break;
+            case 7:
+                std::cout << "Enter the host directory to export to: ";
+                if (!(std::cin >> fileName) || !promptAnswered()) {
+                    break;
+                }
+                printTransferResult("Exported", exportHostDirectory(fileSystem, fileName));
+                break;
+            case 8:
+                return exitWithFinalFlush();
             default:
-                std::cout << "Invalid choice. Please select 1, 2, 3, 4, or 5." << std::endl;
+                std::cout << "Invalid choice. Please select 1-8." << std::endl;
                 break;
         }
     }
 
-    return 0;
+    if (flushRequested) {
+        std::cout << std::endl << "Received SIGINT (Ctrl+C)." << std::endl;
+    }
+    return exitWithFinalFlush();
 }
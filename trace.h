@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Compact binary trace of file system operations, for replay (see replay.cpp).
+//
+// The file starts with the 8-byte magic "FSTRACE1". Each record is
+//   varint  nanoseconds since the previous record
+//   byte    TraceOp
+//   varint  name length, then the name bytes
+//   varint  size (content bytes for CreateOrUpdate, 0 otherwise)
+// Content itself is not recorded; replay synthesizes bytes of the same size.
+
+enum class TraceOp : uint8_t { CreateOrUpdate, Delete, List, Save, Load, Read, Count };
+
+const int traceOpCount = static_cast<int>(TraceOp::Count);
+
+inline const char* traceOpName(int op) {
+    static const char* names[] = {"createOrUpdate", "delete", "list", "save", "load", "read"};
+    return names[op];
+}
+
+const char traceMagic[8] = {'F', 'S', 'T', 'R', 'A', 'C', 'E', '1'};
+
+struct TraceRecord {
+    uint64_t timeNs; // since the start of the trace
+    TraceOp op;
+    std::string name;
+    uint64_t size;
+};
+
+struct TraceWriter {
+    std::ofstream out;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t lastNs = 0;
+
+    explicit TraceWriter(const std::string& path) : out(path, std::ios::binary | std::ios::trunc) {
+        out.write(traceMagic, sizeof(traceMagic));
+    }
+
+    bool good() const {
+        return static_cast<bool>(out);
+    }
+
+    void putVarint(uint64_t value) {
+        char bytes[10];
+        int n = 0;
+        while (value >= 0x80) {
+            bytes[n++] = static_cast<char>(value | 0x80);
+            value >>= 7;
+        }
+        bytes[n++] = static_cast<char>(value);
+        out.write(bytes, n);
+    }
+
+    // Appends with an explicit timestamp; used by the workload generator
+    void record(uint64_t timeNs, TraceOp op, std::string_view name, uint64_t size) {
+        putVarint(timeNs >= lastNs ? timeNs - lastNs : 0);
+        lastNs = std::max(lastNs, timeNs);
+        out.put(static_cast<char>(op));
+        putVarint(name.size());
+        out.write(name.data(), name.size());
+        putVarint(size);
+    }
+
+    void record(TraceOp op, std::string_view name = "", uint64_t size = 0) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), op, name, size);
+    }
+
+    void flush() {
+        out.flush();
+    }
+};
+
+inline bool getVarint(std::istream& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == EOF) {
+            return false;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads a whole trace; returns false if the file is missing or not a trace.
+// A record cut off at the end (e.g. by a crash) ends the trace.
+inline bool readTrace(const std::string& path, std::vector<TraceRecord>& records) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    uint64_t fileSize = in ? static_cast<uint64_t>(in.tellg()) : 0;
+    in.seekg(0);
+    char magic[sizeof(traceMagic)];
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, traceMagic, sizeof(magic)) != 0) {
+        return false;
+    }
+    uint64_t timeNs = 0;
+    uint64_t delta;
+    while (getVarint(in, delta)) {
+        TraceRecord record;
+        timeNs += delta;
+        record.timeNs = timeNs;
+        int op = in.get();
+        uint64_t nameLength;
+        // A name longer than the whole file can only come from a damaged record
+        if (op == EOF || op >= traceOpCount || !getVarint(in, nameLength) || nameLength > fileSize) {
+            break;
+        }
+        record.op = static_cast<TraceOp>(op);
+        record.name.resize(nameLength);
+        if (!in.read(&record.name[0], nameLength) || !getVarint(in, record.size)) {
+            break;
+        }
+        records.push_back(std::move(record));
+    }
+    return true;
+}
@@ -0,0 +1,417 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cctype>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include "filesystem.h"
+
+// Bulk import/export between a host directory tree and the file system.
+//
+// Import walks the host tree with a pool of threads, reads every regular
+// file with a single read into its final buffer on another pool, and feeds
+// the contents to the calling thread, which alone touches the FileSystem.
+// Export writes the latest version of each file straight out of its data
+// blocks with writev, one file per worker at a time.
+//
+// File names are paths relative to the host directory. Names the backup
+// format cannot hold (whitespace) are skipped on import; names that would
+// escape the target directory are skipped on export.
+
+struct TransferResult {
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    uint64_t skipped = 0;
+    uint64_t failed = 0;
+    double seconds = 0;
+};
+
+inline void printTransferResult(const char* verb, const TransferResult& result) {
+    double mb = result.bytes / 1048576.0;
+    std::cout << verb << " " << result.files << " files (" << mb << " MB) in " << result.seconds << " s";
+    if (result.seconds > 0) {
+        std::cout << ", " << result.files / result.seconds << " files/s, " << mb / result.seconds << " MB/s";
+    }
+    std::cout << "; " << result.skipped << " skipped, " << result.failed << " failed." << std::endl;
+}
+
+inline size_t transferThreads() {
+    return std::max(2u, std::thread::hardware_concurrency());
+}
+
+inline bool isStorableName(const std::string& name) {
+    for (char c : name) {
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            return false;
+        }
+    }
+    return !name.empty();
+}
+
+// False for "", which would make every path absolute (root + "/" + name is
+// below "/"), and for anything opendir() refuses
+inline bool isOpenableDirectory(const std::string& dir) {
+    if (dir.empty()) {
+        return false;
+    }
+    DIR* handle = ::opendir(dir.c_str());
+    if (!handle) {
+        return false;
+    }
+    ::closedir(handle);
+    return true;
+}
+
+// Collects the relative paths of all regular files below root; symlinks are
+// not followed. Directories are listed in parallel. Returns nothing for a
+// root that is not an openable directory.
+inline std::vector<std::string> walkHostTree(const std::string& root) {
+    if (!isOpenableDirectory(root)) {
+        return {};
+    }
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<std::string> pendingDirs(1, "");
+    std::vector<std::string> found;
+    size_t busy = 0;
+
+    auto worker = [&] {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] { return !pendingDirs.empty() || busy == 0; });
+            if (pendingDirs.empty()) {
+                return;
+            }
+            std::string dir = std::move(pendingDirs.back());
+            pendingDirs.pop_back();
+            busy++;
+            guard.unlock();
+
+            std::vector<std::string> subdirs;
+            std::vector<std::string> files;
+            DIR* handle = ::opendir((root + "/" + dir).c_str());
+            if (handle) {
+                while (dirent* entry = ::readdir(handle)) {
+                    if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0) {
+                        continue;
+                    }
+                    unsigned char type = entry->d_type;
+                    if (type == DT_UNKNOWN) {
+                        struct stat info;
+                        if (::fstatat(::dirfd(handle), entry->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+                            continue;
+                        }
+                        type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+                    }
+                    std::string path = dir.empty() ? entry->d_name : dir + "/" + entry->d_name;
+                    if (type == DT_DIR) {
+                        subdirs.push_back(std::move(path));
+                    } else if (type == DT_REG) {
+                        files.push_back(std::move(path));
+                    }
+                }
+                ::closedir(handle);
+            }
+
+            guard.lock();
+            busy--;
+            for (std::string& subdir : subdirs) {
+                pendingDirs.push_back(std::move(subdir));
+            }
+            for (std::string& file : files) {
+                found.push_back(std::move(file));
+            }
+            wake.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < transferThreads(); i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return found;
+}
+
+// Reads a whole host file into content with as few read calls as the
+// kernel allows
+inline bool readHostFile(const std::string& path, std::pmr::string& content) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        return false;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    content.resize(info.st_size);
+    size_t done = 0;
+    while (done < content.size()) {
+        ssize_t n = ::read(fd, &content[done], content.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    ::close(fd);
+    content.resize(done); // the file may have shrunk while being read
+    return true;
+}
+
+// Hands file contents from the reader pool to the importing thread. Readers
+// block while more than maxBytes are queued, so huge trees and huge files
+// never have more than about maxBytes plus one file in flight.
+struct ImportQueue {
+    static const uint64_t maxBytes = 256 << 20;
+
+    std::mutex lock;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<std::pair<std::string, std::pmr::string>> items;
+    uint64_t queuedBytes = 0;
+    size_t readersLeft = 0;
+
+    void push(std::string name, std::pmr::string content) {
+        std::unique_lock<std::mutex> guard(lock);
+        notFull.wait(guard, [this] { return queuedBytes < maxBytes || items.empty(); });
+        queuedBytes += content.size();
+        items.emplace_back(std::move(name), std::move(content));
+        notEmpty.notify_one();
+    }
+
+    void readerDone() {
+        std::lock_guard<std::mutex> guard(lock);
+        readersLeft--;
+        notEmpty.notify_all();
+    }
+
+    // Returns false once every reader is done and the queue is drained
+    bool pop(std::pair<std::string, std::pmr::string>& item) {
+        std::unique_lock<std::mutex> guard(lock);
+        notEmpty.wait(guard, [this] { return !items.empty() || readersLeft == 0; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        queuedBytes -= item.second.size();
+        notFull.notify_all();
+        return true;
+    }
+};
+
+inline TransferResult importHostDirectory(FileSystem& fs, const std::string& hostDir) {
+    FS_TIME_OP(Op::Import);
+    auto start = std::chrono::steady_clock::now();
+    TransferResult result;
+    if (!isOpenableDirectory(hostDir)) {
+        std::cout << "Cannot open host directory '" << hostDir << "'." << std::endl;
+        result.failed = 1;
+        return result;
+    }
+    std::vector<std::string> names = walkHostTree(hostDir);
+
+    ImportQueue queue;
+    std::atomic<size_t> next(0);
+    std::atomic<uint64_t> skipped(0);
+    std::atomic<uint64_t> failed(0);
+    size_t readers = std::min(transferThreads(), std::max<size_t>(1, names.size()));
+    queue.readersLeft = readers;
+
+    std::vector<std::thread> threads;
+    for (size_t r = 0; r < readers; r++) {
+        threads.emplace_back([&] {
+            for (size_t i = next++; i < names.size(); i = next++) {
+                if (!isStorableName(names[i])) {
+                    skipped++;
+                    continue;
+                }
+                std::pmr::string content(&fs.importArena);
+                if (!readHostFile(hostDir + "/" + names[i], content)) {
+                    failed++;
+                    continue;
+                }
+                queue.push(std::move(names[i]), std::move(content));
+            }
+            queue.readerDone();
+        });
+    }
+
+    bool verbose = fs.verbose;
+    fs.verbose = false;
+    // item.second shares the readers' resource, so moving a payload in and
+    // on to the file system hands the buffer over instead of copying it
+    std::pair<std::string, std::pmr::string> item(std::string(), &fs.importArena);
+    while (queue.pop(item)) {
+        result.files++;
+        result.bytes += item.second.size();
+        fs.addOrUpdateFile(item.first, std::move(item.second));
+    }
+    fs.verbose = verbose;
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    result.skipped = skipped;
+    result.failed = failed;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+inline bool isSafeRelativePath(std::string_view name) {
+    if (name.empty() || name[0] == '/') {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= name.size()) {
+        size_t end = name.find('/', start);
+        if (end == std::string::npos) {
+            end = name.size();
+        }
+        std::string_view part = name.substr(start, end - start);
+        if (part.empty() || part == "." || part == "..") {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+// Creates every missing directory on the way to path's parent
+inline void createParentDirectories(const std::string& path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        ::mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+}
+
+// Writes the latest version of file, gathering its blocks with writev
+inline bool exportFile(const FileSystem& fs, const File& file, const std::string& path, uint64_t& bytes) {
+    createParentDirectories(path);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    size_t latest = std::min(file.latestBlockCount, file.allocatedBlocks.size());
+    size_t first = file.allocatedBlocks.size() - latest;
+    std::vector<iovec> iov;
+    iov.reserve(std::min<size_t>(latest, IOV_MAX));
+    bool ok = true;
+    size_t blockPos = first;
+    while (ok && blockPos < file.allocatedBlocks.size()) {
+        iov.clear();
+        while (blockPos < file.allocatedBlocks.size() && iov.size() < IOV_MAX) {
+            int blockIndex = file.allocatedBlocks[blockPos++];
+            if (blockIndex < 0 || static_cast<size_t>(blockIndex) >= fs.dataBlocks.size()) {
+                ok = false;
+                break;
+            }
+            std::string_view content = fs.dataBlocks[blockIndex].content;
+            iov.push_back(iovec{const_cast<char*>(content.data()), content.size()});
+        }
+
+        // writev may stop part way; skip what was written and go again
+        size_t done = 0;
+        while (ok && done < iov.size()) {
+            ssize_t n = ::writev(fd, &iov[done], std::min<size_t>(iov.size() - done, IOV_MAX));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                ok = false;
+                break;
+            }
+            bytes += n;
+            while (done < iov.size() && static_cast<size_t>(n) >= iov[done].iov_len) {
+                n -= iov[done].iov_len;
+                done++;
+            }
+            if (done < iov.size()) {
+                iov[done].iov_base = static_cast<char*>(iov[done].iov_base) + n;
+                iov[done].iov_len -= n;
+            }
+        }
+    }
+    return ::close(fd) == 0 && ok;
+}
+
+// Exports every file not marked for deletion
+inline TransferResult exportHostDirectory(const FileSystem& fs, const std::string& hostDir) {
+    FS_TIME_OP(Op::Export);
+    auto start = std::chrono::steady_clock::now();
+    if (!hostDir.empty()) {
+        ::mkdir(hostDir.c_str(), 0755);
+    }
+    if (!isOpenableDirectory(hostDir)) {
+        std::cout << "Cannot open host directory '" << hostDir << "'." << std::endl;
+        TransferResult result;
+        result.failed = 1;
+        return result;
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<uint64_t> files(0);
+    std::atomic<uint64_t> bytes(0);
+    std::atomic<uint64_t> skipped(0);
+    std::atomic<uint64_t> failed(0);
+    auto worker = [&] {
+        uint64_t written = 0;
+        for (size_t i = next++; i < fs.files.size(); i = next++) {
+            const File& file = fs.files[i];
+            if (file.metadata.deletionMark || !isSafeRelativePath(file.name)) {
+                skipped++;
+                continue;
+            }
+            if (exportFile(fs, file, hostDir + "/" + std::string(file.name.data(), file.name.size()), written)) {
+                files++;
+            } else {
+                failed++;
+            }
+        }
+        bytes += written;
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < transferThreads(); i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    TransferResult result;
+    result.files = files;
+    result.bytes = bytes;
+    result.skipped = skipped;
+    result.failed = failed;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}